@@ -109,3 +109,178 @@ def test_1d_tsne():
     Y = vis.fit_transform(X).ravel()
     n_pos = np.count_nonzero(Y - Y.mean() > 0)
     assert np.abs(n_pos - n) < 5, "Clustering quality is too poor"
+
+
+def test_callback():
+    np.random.seed(42)
+    X = np.random.random((200, 5))
+    n_epochs = 20
+    snapshots = []
+
+    def callback(Y, Q, epoch):
+        snapshots.append((Y, Q, epoch))
+
+    vis = ncvis.NCVis(n_epochs=n_epochs, n_threads=2, random_seed=42)
+    Y = vis.fit_transform(X, callback=callback, callback_every=3)
+    epochs = [epoch for _, _, epoch in snapshots]
+    assert epochs == [2, 5, 8, 11, 14, 17, 19], "Unexpected callback epochs"
+    assert snapshots[-1][0].shape == Y.shape, "Snapshot shape differs from the embedding"
+    assert np.array_equal(snapshots[-1][0], Y), "Last snapshot differs from the result"
+
+    # Returning False cancels the optimization
+    epochs = []
+
+    def cancel(Y, Q, epoch):
+        epochs.append(epoch)
+        return epoch < 4
+
+    Y = vis.fit_transform(X, callback=cancel)
+    assert epochs == [0, 1, 2, 3, 4], "Optimization was not cancelled"
+    assert np.all(np.isfinite(Y)), "All entries must be finite"
+
+
+def test_partial_fit():
+    np.random.seed(42)
+    n = 100
+    centers = np.array([[-5.0, 0.0, 0.0], [5.0, 0.0, 0.0]])
+    X = np.concatenate((np.random.normal(centers[0], 1, (n, 3)), np.random.normal(centers[1], 1, (n, 3))))
+    X_new = np.random.normal(centers[0], 1, (n // 10, 3))
+
+    vis = ncvis.NCVis(n_neighbors=15, n_threads=2, random_seed=42, keep_index=True)
+    Y = vis.fit_transform(X)
+    Y_all = vis.partial_fit(X_new, Y)
+    assert Y_all.shape == (2 * n + n // 10, 2), "Unexpected embedding shape"
+    assert np.all(np.isfinite(Y_all)), "All entries must be finite"
+
+    Y_new = Y_all[2 * n:]
+    dist_own = np.linalg.norm(Y_new - Y_all[:n].mean(axis=0), axis=1)
+    dist_other = np.linalg.norm(Y_new - Y_all[n : 2 * n].mean(axis=0), axis=1)
+    assert np.all(dist_own < dist_other), "New points are placed in the wrong cluster"
+
+
+def test_sharded(capsys: CaptureFixture):
+    np.random.seed(42)
+    n = 2 * 10**3
+    X = np.concatenate((np.random.normal(-5, 1, (n, 10)), np.random.normal(5, 1, (n, 10))))
+    times = {}
+    for n_workers in [1, 2]:
+        vis = ncvis.NCVis(
+            n_neighbors=15,
+            M=16,
+            ef_construction=200,
+            random_seed=42,
+            n_init_epochs=20,
+            n_epochs=50,
+            min_dist=0.4,
+            n_threads=2,
+            n_workers=n_workers,
+        )
+        start = time.time()
+        Y = vis.fit_transform(X)
+        stop = time.time()
+        times[n_workers] = stop - start
+
+        with capsys.disabled():
+            print(f"n_workers = {n_workers}, time = {times[n_workers]:.2f}s")
+        assert np.all(np.isfinite(Y)), "All entries must be finite"
+        gap = np.linalg.norm(Y[:n].mean(axis=0) - Y[n:].mean(axis=0))
+        spread = max(Y[:n].std(axis=0).max(), Y[n:].std(axis=0).max())
+        assert gap > 2 * spread, "Clusters are not separated"
+
+
+def knn_preservation(X, Y, k=15):
+    def knn(Z):
+        sq = (Z * Z).sum(axis=1)
+        dist = sq[:, None] + sq[None, :] - 2 * Z @ Z.T
+        np.fill_diagonal(dist, np.inf)
+        return np.argsort(dist, axis=1)[:, :k]
+
+    inds_X, inds_Y = knn(X.astype(np.float64)), knn(Y.astype(np.float64))
+    return np.mean([len(np.intersect1d(x, y)) for x, y in zip(inds_X, inds_Y)]) / k
+
+
+def test_sharded_sync():
+    np.random.seed(42)
+    n = 10**3
+    X = np.concatenate((np.random.normal(-5, 1, (n, 10)), np.random.normal(5, 1, (n, 10))))
+    # Every epoch is a separate optimize call on the workers, which should
+    # not draw the same noise samples over and over again
+    preservation = {}
+    for n_workers in [1, 2]:
+        vis = ncvis.NCVis(
+            n_neighbors=15,
+            M=16,
+            ef_construction=200,
+            random_seed=42,
+            n_init_epochs=20,
+            n_epochs=50,
+            min_dist=0.4,
+            n_noise=3,
+            n_threads=2,
+            n_workers=n_workers,
+            sync_every=1,
+        )
+        Y = vis.fit_transform(X)
+        assert np.all(np.isfinite(Y)), "All entries must be finite"
+        preservation[n_workers] = knn_preservation(X, Y)
+
+    assert preservation[2] > 0.9 * preservation[1], "Sharded embedding is worse than the single process one"
+
+
+def test_partial_fit_degrees():
+    np.random.seed(42)
+    n_neighbors = 15
+    X = np.random.normal(0, 1, (300, 3))
+
+    vis = ncvis.NCVis(n_neighbors=n_neighbors, n_threads=2, random_seed=42, keep_index=True)
+    Y = vis.fit_transform(X)
+    degrees = vis.degrees()
+    # Daily updates concentrated around a single point
+    for _ in range(5):
+        Y = vis.partial_fit(np.random.normal(X[0], 0.1, (60, 3)), Y)
+    assert Y.shape == (600, 2), "Unexpected embedding shape"
+    assert np.all(np.isfinite(Y)), "All entries must be finite"
+
+    degrees_after = vis.degrees()
+    bound = np.maximum(degrees, 2 * n_neighbors)
+    assert np.all(degrees_after[:300] <= bound), "Rows of old points grow without bound"
+    assert np.all(degrees_after[300:] <= 2 * n_neighbors), "Rows of new points grow without bound"
+
+
+def check_partition(edges, n_parts):
+    model = ncvis.NCVis(n_threads=1).model
+    model.set_edges(np.array(edges, dtype=np.uintp).reshape(-1, 2))
+    bounds = model.partition_edges(n_parts)
+    n_edges = len(edges)
+    assert len(bounds) == n_parts + 1, "Expected n_parts+1 boundaries"
+    assert bounds[0] == 0 and bounds[-1] == n_edges, "Boundaries should cover all the edges"
+    assert all(b1 <= b2 for b1, b2 in zip(bounds, bounds[1:])), "Boundaries should not decrease"
+    # Only hubs, rows heavier than a quarter of a part, may be cut
+    share = (n_edges + n_parts - 1) // n_parts
+    degrees = np.bincount([e[0] for e in edges]) if n_edges else np.zeros(0, dtype=int)
+    for b in bounds[1:-1]:
+        if 0 < b < n_edges and edges[b - 1][0] == edges[b][0]:
+            assert degrees[edges[b][0]] > max(share // 4, 1), "An ordinary row was split"
+    return bounds
+
+
+def test_partition_edges():
+    # Star: a hub holding half of the edges is split evenly
+    star = sorted([(0, j) for j in range(1, 601)] + [(i, 0) for i in range(1, 601)])
+    assert check_partition(star, 4) == [0, 300, 600, 900, 1200]
+    sizes = np.diff(check_partition(star, 7))
+    assert sizes.min() >= 171 and sizes.max() <= 172, "Star is not split evenly"
+
+    # One dominant hub among ordinary rows
+    np.random.seed(42)
+    edges = []
+    for i in range(200):
+        degree = 1000 if i == 50 else np.random.randint(5, 20)
+        edges += [(i, j) for j in range(degree)]
+    for n_parts in [2, 8, 32]:
+        sizes = np.diff(check_partition(edges, n_parts))
+        assert sizes.max() <= 1.25 * len(edges) / n_parts + 1, "Parts are not balanced"
+
+    # More parts than edges and no edges at all
+    check_partition([(0, 1), (1, 0), (1, 2)], 8)
+    assert check_partition([], 4) == [0, 0, 0, 0, 0]
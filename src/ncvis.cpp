@@ -2,16 +2,95 @@
 
 #include <omp.h>
 
+#include <algorithm>
+#include <atomic>
 #include <chrono>
 #include <cmath>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
 #include <random>
+#include <thread>
 
 #include "../lib/hnswlib/hnswlib/hnswlib.h"
 #include "../lib/pcg-cpp/include/pcg_random.hpp"
 
+namespace {
+// Passes copies of the embedding to a separate thread that runs the user
+// callback, so the optimization is only held for the copy. There are two
+// buffers: one may be read by the callback while the other is filled.
+class SnapshotQueue {
+   public:
+    SnapshotQueue(ncvis::SnapshotCallback callback, void *data, size_t N, size_t d) : callback_(callback), data_(data), N_(N), d_(d), pending_(-1), next_(0), done_(false), cancelled_(false) {
+        buffers_[0].resize(N * d);
+        buffers_[1].resize(N * d);
+        thread_ = std::thread(&SnapshotQueue::run, this);
+    }
+
+    ~SnapshotQueue() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            done_ = true;
+        }
+        cv_.notify_all();
+        thread_.join();
+    }
+
+    // Waits only if the previous snapshot has not been taken by the callback yet
+    void push(const float *Y, float Q, int epoch) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [this] { return pending_ < 0; });
+        std::copy(Y, Y + N_ * d_, buffers_[next_].begin());
+        Q_[next_] = Q;
+        epoch_[next_] = epoch;
+        pending_ = next_;
+        next_ = 1 - next_;
+        lock.unlock();
+        cv_.notify_all();
+    }
+
+    bool cancelled() const {
+        return cancelled_;
+    }
+
+   private:
+    void run() {
+        while (true) {
+            std::unique_lock<std::mutex> lock(mutex_);
+            cv_.wait(lock, [this] { return pending_ >= 0 || done_; });
+            if (pending_ < 0) {
+                break;
+            }
+            int cur = pending_;
+            pending_ = -1;
+            lock.unlock();
+            cv_.notify_all();
+            if (!cancelled_ && !callback_(buffers_[cur].data(), N_, d_, Q_[cur], epoch_[cur], data_)) {
+                cancelled_ = true;
+            }
+        }
+    }
+
+    ncvis::SnapshotCallback callback_;
+    void *data_;
+    size_t N_;
+    size_t d_;
+    std::vector<float> buffers_[2];
+    float Q_[2];
+    int epoch_[2];
+    int pending_;
+    int next_;
+    bool done_;
+    std::atomic<bool> cancelled_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::thread thread_;
+};
+}  // namespace
+
 ncvis::NCVis::NCVis(size_t d, size_t n_threads, size_t n_neighbors, size_t M,
                     size_t ef_construction, size_t random_seed, int n_epochs,
-                    int n_init_epochs, float a, float b, float alpha, float alpha_Q, size_t *n_noise, ncvis::Distance dist) : d_(d), M_(M), ef_construction_(ef_construction), random_seed_(random_seed), n_neighbors_(n_neighbors), n_epochs_(n_epochs), n_init_epochs_(n_init_epochs), a_(a), b_(b), alpha_(alpha), alpha_Q_(alpha_Q), space_(nullptr), appr_alg_(nullptr), dist_(dist) {
+                    int n_init_epochs, float a, float b, float alpha, float alpha_Q, size_t *n_noise, ncvis::Distance dist, bool keep_index) : d_(d), M_(M), ef_construction_(ef_construction), random_seed_(random_seed), n_neighbors_(n_neighbors), n_epochs_(n_epochs), n_init_epochs_(n_init_epochs), a_(a), b_(b), alpha_(alpha), alpha_Q_(alpha_Q), callback_(nullptr), callback_data_(nullptr), callback_every_(1), n_runs_(0), keep_index_(keep_index), N_(0), D_(0), Q_(0), space_(nullptr), appr_alg_(nullptr), dist_(dist) {
     omp_set_num_threads(n_threads);
     n_noise_ = new size_t[n_epochs];
     size_t default_noise = 3;
@@ -29,6 +108,15 @@ ncvis::NCVis::~NCVis() {
     n_noise_ = nullptr;
 }
 
+void ncvis::NCVis::set_snapshot_callback(ncvis::SnapshotCallback callback, void *data, int every) {
+    if (every < 1) {
+        throw std::runtime_error("[ncvis::NCVis::set_snapshot_callback] Callback period should be at least 1.");
+    }
+    callback_ = callback;
+    callback_data_ = data;
+    callback_every_ = every;
+}
+
 void ncvis::NCVis::preprocess(const float *const x, size_t D, ncvis::Distance dist, float *out) {
     if (dist == ncvis::Distance::correlation) {
         float M = 0;
@@ -98,6 +186,10 @@ void ncvis::NCVis::buildKNN(const float *const X, size_t N, size_t D) {
     appr_alg_->addPoint((void *)x, 0);
     delete[] x;
 
+    add_points(X + D, N - 1, D, 1);
+}
+
+void ncvis::NCVis::add_points(const float *const X, size_t N, size_t D, size_t first_label) {
 #pragma omp parallel
     {
         float *x = new float[D];
@@ -107,7 +199,7 @@ void ncvis::NCVis::buildKNN(const float *const X, size_t N, size_t D) {
         // signed integral type"
         // So I had to replace `size_t` with `long long`, which is error-prone
 #pragma omp for
-        for (long long i = 1; i < N; ++i) {
+        for (long long i = 0; i < N; ++i) {
             // printf("[%lu]>> [", i);
             // for (size_t j=0; j<D; ++j){
             //     printf("%5.1f ", X[j+D*i]);
@@ -119,7 +211,7 @@ void ncvis::NCVis::buildKNN(const float *const X, size_t N, size_t D) {
             //     printf("%5.1f ", x[j]);
             // }
             // printf("]\n");
-            appr_alg_->addPoint((void *)x, i);
+            appr_alg_->addPoint((void *)x, first_label + i);
         }
         delete[] x;
     }
@@ -172,6 +264,38 @@ std::vector<ncvis::Edge> ncvis::NCVis::build_edges(ncvis::KNNTable &table) {
     return edges;
 }
 
+std::vector<size_t> ncvis::NCVis::partition_edges(std::vector<ncvis::Edge> &edges, size_t n_parts) {
+    // Edges are sorted by the first endpoint, so each row owns a contiguous
+    // run of edges whose length is its degree. Rows of ordinary degree are
+    // never split, so a single part writes them. Hubs, rows heavier than a
+    // quarter of a part, are cut exactly at the part end: this shares a hub
+    // between the fewest parts possible while keeping the load even.
+    size_t n_edges = edges.size();
+    size_t share = (n_edges + n_parts - 1) / n_parts;
+    size_t hub_degree = std::max<size_t>(share / 4, 1);
+
+    std::vector<size_t> bounds(n_parts + 1);
+    bounds[0] = 0;
+    bounds[n_parts] = n_edges;
+    auto before_row = [](const ncvis::Edge &e, size_t row) { return e.first < row; };
+    auto after_row = [](size_t row, const ncvis::Edge &e) { return row < e.first; };
+    for (size_t t = 1; t < n_parts; ++t) {
+        size_t pos = t * n_edges / n_parts;
+        size_t bound = pos;
+        if (pos < n_edges) {
+            size_t row = edges[pos].first;
+            size_t lo = std::lower_bound(edges.begin(), edges.begin() + pos, row, before_row) - edges.begin();
+            size_t hi = std::upper_bound(edges.begin() + pos, edges.end(), row, after_row) - edges.begin();
+            if (hi - lo <= hub_degree) {
+                bound = (pos - lo <= hi - pos) ? lo : hi;
+            }
+        }
+        bounds[t] = std::max(bound, bounds[t - 1]);
+    }
+
+    return bounds;
+}
+
 float ncvis::NCVis::d_sqr(const float *const x, const float *const y) {
     float dist_sqr = 0;
     for (size_t i = 0; i < d_; ++i) {
@@ -272,23 +396,40 @@ void ncvis::NCVis::init_embedding(size_t N, float *Y, float alpha, std::vector<n
     delete[] sigma;
 }
 
-void ncvis::NCVis::optimize(size_t N, float *Y, float &Q, std::vector<ncvis::Edge> &edges) {
+void ncvis::NCVis::optimize(size_t N, float *Y, float &Q, std::vector<ncvis::Edge> &edges, int first_epoch, int last_epoch) {
+    if (first_epoch < 0 || first_epoch > last_epoch || last_epoch > n_epochs_) {
+        throw std::runtime_error("[ncvis::NCVis::optimize] Epochs range should lie within [0, n_epochs].");
+    }
     float Q_cum = 0.;
+    bool stop = false;
+    std::vector<size_t> bounds;
+    std::unique_ptr<SnapshotQueue> snapshots;
+    if (callback_ != nullptr) {
+        snapshots.reset(new SnapshotQueue(callback_, callback_data_, N, d_));
+    }
 #pragma omp parallel
     {
         int id = omp_get_thread_num();
         int n_threads = omp_get_num_threads();
         pcg64 pcg(random_seed_ + id);
+        // Jump ahead on each later call, so that neither partial_fit nor the
+        // sync periods of a sharded run replay the noise samples of the
+        // previous calls
+        pcg.advance(static_cast<pcg64::state_type>(n_runs_) << 64);
+#pragma omp single
+        bounds = partition_edges(edges, n_threads);
+        // Each thread keeps the same range of edges for all epochs
+        size_t edges_begin = bounds[id];
+        size_t edges_end = bounds[id + 1];
         // Build layout
         std::uniform_int_distribution<size_t> gen_ind(0, N - 1);
 
-        for (int epoch = 0; epoch < n_epochs_; ++epoch) {
+        for (int epoch = first_epoch; epoch < last_epoch; ++epoch) {
             // Hogwild: lock-free parameters reading and writing
             float step = alpha_ * (1 - (((float)epoch) / n_epochs_) * (((float)epoch) / n_epochs_));
             float Q_copy = Q;
             size_t cur_noise = n_noise_[epoch];
-#pragma omp for nowait
-            for (long long i = 0; i < edges.size(); ++i) {
+            for (size_t i = edges_begin; i < edges_end; ++i) {
                 // printf("[%d] (%ld, %ld)\n", epoch, edges[i].first, edges[i].second);
                 size_t id = edges[i].first;
                 for (size_t j = 0; j < cur_noise + 1; ++j) {
@@ -325,6 +466,13 @@ void ncvis::NCVis::optimize(size_t N, float *Y, float &Q, std::vector<ncvis::Edg
                     // {
                     // printf("[%d:%d] Q = %f\n", epoch, omp_get_thread_num(), Q);
                     // }
+                    // A positive sample only moves the row owned by this thread,
+                    // with the step of the former two-sided update. The other
+                    // endpoint is moved by the reverse edge, if the edge list
+                    // holds it; a one-way edge only pulls its first endpoint.
+                    if (j == 0) {
+                        w *= 2;
+                    }
                     // Also non-blocking write
                     for (size_t k = 0; k < d_; ++k) {
                         float dx_k = Y[other_id * d_ + k] - Y[id * d_ + k];
@@ -335,7 +483,9 @@ void ncvis::NCVis::optimize(size_t N, float *Y, float &Q, std::vector<ncvis::Edg
                             dx_k = -4.;
                         }
                         Y[id * d_ + k] += dx_k;
-                        Y[other_id * d_ + k] -= dx_k;
+                        if (j != 0) {
+                            Y[other_id * d_ + k] -= dx_k;
+                        }
                     }
                 }
             }
@@ -346,12 +496,23 @@ void ncvis::NCVis::optimize(size_t N, float *Y, float &Q, std::vector<ncvis::Edg
             {
                 Q = Q_cum / n_threads;
                 Q_cum = 0;
+                // Other threads are held by the implicit barrier, so the copy is consistent
+                if (snapshots && ((epoch + 1) % callback_every_ == 0 || epoch + 1 == last_epoch)) {
+                    stop = snapshots->cancelled();
+                    if (!stop) {
+                        snapshots->push(Y, Q, epoch);
+                    }
+                }
+            }
+            if (stop) {
+                break;
             }
         }
     }
+    ++n_runs_;
 }
 
-void ncvis::NCVis::fit_transform(const float *const X, size_t N, size_t D, float *Y) {
+std::vector<ncvis::Edge> ncvis::NCVis::init_transform(const float *const X, size_t N, size_t D, float *Y) {
     // printf("==============DATA============\n");
     // for (size_t i=0; i<N; ++i){
     //     printf("[");
@@ -362,11 +523,12 @@ void ncvis::NCVis::fit_transform(const float *const X, size_t N, size_t D, float
     // }
     // printf("===============================\n");
     if (N == 0 || D == 0) {
-        throw std::runtime_error("[ncvis::NCVis::fit_transform] Dataset should have at least one element.");
+        throw std::runtime_error("[ncvis::NCVis::init_transform] Dataset should have at least one element.");
     }
     if (Y == nullptr) {
-        throw std::runtime_error("[ncvis::NCVis::fit_transform] Null pointer provided for output.");
+        throw std::runtime_error("[ncvis::NCVis::init_transform] Null pointer provided for output.");
     }
+    n_runs_ = 0;
 #if defined(DEBUG)
     auto t1 = std::chrono::high_resolution_clock::now();
 #endif
@@ -386,10 +548,12 @@ void ncvis::NCVis::fit_transform(const float *const X, size_t N, size_t D, float
     KNNTable table = findKNN(X, N, D, k);
 
     // The graph itself is no size_t er needed
-    delete appr_alg_;
-    appr_alg_ = nullptr;
-    delete space_;
-    space_ = nullptr;
+    if (!keep_index_) {
+        delete appr_alg_;
+        appr_alg_ = nullptr;
+        delete space_;
+        space_ = nullptr;
+    }
 
 #if defined(DEBUG)
     t2 = std::chrono::high_resolution_clock::now();
@@ -413,8 +577,6 @@ void ncvis::NCVis::fit_transform(const float *const X, size_t N, size_t D, float
               << std::chrono::duration_cast<std::chrono::milliseconds>(t2 - t1).count()
               << " ms\n";
 #endif
-    // Normalization
-    float Q = 0.;
     float init_alpha = 1. / k;
 
 #if defined(DEBUG)
@@ -428,15 +590,13 @@ void ncvis::NCVis::fit_transform(const float *const X, size_t N, size_t D, float
     std::cout << "initialize: "
               << std::chrono::duration_cast<std::chrono::milliseconds>(t2 - t1).count()
               << " ms\n";
-    t1 = std::chrono::high_resolution_clock::now();
-#endif
-    optimize(N, Y, Q, edges);
-#if defined(DEBUG)
-    t2 = std::chrono::high_resolution_clock::now();
-    std::cout << "optimize: "
-              << std::chrono::duration_cast<std::chrono::milliseconds>(t2 - t1).count()
-              << " ms\n";
 #endif
+    if (keep_index_) {
+        N_ = N;
+        D_ = D;
+        neighbors_.swap(table.inds);
+        neighbor_dists_.swap(table.dists);
+    }
     // printf("============DISTANCES==========\n");
     // for (size_t i=0; i<N; ++i){
     //     printf("[");
@@ -456,4 +616,187 @@ void ncvis::NCVis::fit_transform(const float *const X, size_t N, size_t D, float
     //     printf("]\n");
     // }
     // printf("===============================\n");
+    return edges;
+}
+
+void ncvis::NCVis::fit_transform(const float *const X, size_t N, size_t D, float *Y) {
+    std::vector<ncvis::Edge> edges = init_transform(X, N, D, Y);
+    // Normalization
+    float Q = 0.;
+#if defined(DEBUG)
+    auto t1 = std::chrono::high_resolution_clock::now();
+#endif
+    optimize(N, Y, Q, edges, 0, n_epochs_);
+#if defined(DEBUG)
+    auto t2 = std::chrono::high_resolution_clock::now();
+    std::cout << "optimize: "
+              << std::chrono::duration_cast<std::chrono::milliseconds>(t2 - t1).count()
+              << " ms\n";
+#endif
+    if (keep_index_) {
+        Q_ = Q;
+    }
+}
+
+void ncvis::NCVis::partial_fit(const float *const X, size_t N, size_t D, float *Y, int n_epochs) {
+    if (appr_alg_ == nullptr || N_ == 0) {
+        throw std::runtime_error("[ncvis::NCVis::partial_fit] No index to add points to, call fit_transform first with keep_index set.");
+    }
+    if (D != D_) {
+        throw std::runtime_error("[ncvis::NCVis::partial_fit] Dimensionality of samples differs from the fitted one.");
+    }
+    if (Y == nullptr) {
+        throw std::runtime_error("[ncvis::NCVis::partial_fit] Null pointer provided for output.");
+    }
+    if (N == 0) {
+        return;
+    }
+    size_t N_old = N_;
+    size_t N_total = N_old + N;
+#if defined(DEBUG)
+    auto t1 = std::chrono::high_resolution_clock::now();
+#endif
+    // Resizing copies the whole index, so the capacity grows geometrically
+    if (appr_alg_->getMaxElements() < N_total) {
+        appr_alg_->resizeIndex(std::max(N_total, 2 * appr_alg_->getMaxElements()));
+    }
+    add_points(X, N, D, N_old);
+    size_t n_neighbors = (n_neighbors_ < N_total - 1) ? n_neighbors_ : (N_total - 1);
+    KNNTable table = findKNN(X, N, D, n_neighbors);
+#if defined(DEBUG)
+    auto t2 = std::chrono::high_resolution_clock::now();
+    std::cout << "partial_fit/findKNN: "
+              << std::chrono::duration_cast<std::chrono::milliseconds>(t2 - t1).count()
+              << " ms\n";
+    t1 = std::chrono::high_resolution_clock::now();
+#endif
+
+    // Symmetrize only the rows touched by the new points. Rows are kept sorted
+    // by distance and are not allowed to grow past the size reserved by
+    // KNNTable for symmetrization: once a row is full, a new point only
+    // replaces its farthest neighbor if it is closer. Otherwise repeated
+    // updates would turn the rows next to dense insertions into hubs. Edges
+    // rejected or evicted by a full row stay one-way, so optimize pulls the
+    // point listing the neighbor but leaves the full row's point in place.
+    size_t max_degree = 2 * n_neighbors;
+    neighbors_.resize(N_total);
+    neighbor_dists_.resize(N_total);
+    for (size_t i = 0; i < N; ++i) {
+        // findKNN lists the neighbors from the farthest one
+        neighbors_[N_old + i].assign(table.inds[i].rbegin(), table.inds[i].rend());
+        neighbor_dists_[N_old + i].assign(table.dists[i].rbegin(), table.dists[i].rend());
+    }
+    std::vector<size_t> affected;
+    affected.reserve(N * (n_neighbors + 1));
+    for (size_t i = 0; i < N; ++i) {
+        affected.push_back(N_old + i);
+        for (size_t j = 0; j < table.inds[i].size(); ++j) {
+            size_t other_id = table.inds[i][j];
+            float dist = table.dists[i][j];
+            std::vector<long> &inds = neighbors_[other_id];
+            std::vector<float> &dists = neighbor_dists_[other_id];
+            if (std::find(inds.begin(), inds.end(), (long)(N_old + i)) != inds.end()) {
+                continue;
+            }
+            bool full = !inds.empty() && inds.size() >= max_degree;
+            if (full && dist >= dists.back()) {
+                continue;
+            }
+            size_t pos = std::upper_bound(dists.begin(), dists.end(), dist) - dists.begin();
+            inds.insert(inds.begin() + pos, N_old + i);
+            dists.insert(dists.begin() + pos, dist);
+            if (full) {
+                inds.pop_back();
+                dists.pop_back();
+            }
+            affected.push_back(other_id);
+        }
+    }
+    std::sort(affected.begin(), affected.end());
+    affected.erase(std::unique(affected.begin(), affected.end()), affected.end());
+
+    std::vector<ncvis::Edge> edges;
+    for (size_t i = 0; i < affected.size(); ++i) {
+        for (size_t j = 0; j < neighbors_[affected[i]].size(); ++j) {
+            edges.emplace_back(affected[i], neighbors_[affected[i]][j]);
+        }
+    }
+#if defined(DEBUG)
+    t2 = std::chrono::high_resolution_clock::now();
+    std::cout << "partial_fit/symmetrize: "
+              << std::chrono::duration_cast<std::chrono::milliseconds>(t2 - t1).count()
+              << " ms\n";
+    t1 = std::chrono::high_resolution_clock::now();
+#endif
+
+    // Warm start: the mean of the old neighbors (or a random old point if
+    // there are none), jittered by a fraction of their spread so that points
+    // with the same neighbors do not coincide
+#pragma omp parallel
+    {
+        int id = omp_get_thread_num();
+        pcg64 pcg(random_seed_ + id);
+        pcg.advance(static_cast<pcg64::state_type>(n_runs_) << 64);
+        std::uniform_real_distribution<float> gen_jitter(-0.1, 0.1);
+        std::uniform_int_distribution<size_t> gen_ind(0, N_old - 1);
+#pragma omp for
+        for (long long i = N_old; i < N_total; ++i) {
+            float *y = Y + i * d_;
+            size_t n_old = 0;
+            for (size_t k = 0; k < d_; ++k) {
+                y[k] = 0;
+            }
+            for (size_t j = 0; j < neighbors_[i].size(); ++j) {
+                size_t other_id = neighbors_[i][j];
+                if (other_id < N_old) {
+                    for (size_t k = 0; k < d_; ++k) {
+                        y[k] += Y[other_id * d_ + k];
+                    }
+                    ++n_old;
+                }
+            }
+            float spread = 1.;
+            if (n_old == 0) {
+                size_t other_id = gen_ind(pcg);
+                for (size_t k = 0; k < d_; ++k) {
+                    y[k] = Y[other_id * d_ + k];
+                }
+            } else {
+                for (size_t k = 0; k < d_; ++k) {
+                    y[k] /= n_old;
+                }
+                spread = 0;
+                for (size_t j = 0; j < neighbors_[i].size(); ++j) {
+                    size_t other_id = neighbors_[i][j];
+                    if (other_id < N_old) {
+                        spread += sqrtf(d_sqr(y, Y + other_id * d_));
+                    }
+                }
+                spread = (spread > 0) ? spread / n_old : 1.;
+            }
+            for (size_t k = 0; k < d_; ++k) {
+                y[k] += spread * gen_jitter(pcg);
+            }
+        }
+    }
+
+    n_epochs = (n_epochs < n_epochs_) ? n_epochs : n_epochs_;
+    // Resume the tail of the schedule: small steps and full noise
+    optimize(N_total, Y, Q_, edges, n_epochs_ - n_epochs, n_epochs_);
+#if defined(DEBUG)
+    t2 = std::chrono::high_resolution_clock::now();
+    std::cout << "partial_fit/optimize: "
+              << std::chrono::duration_cast<std::chrono::milliseconds>(t2 - t1).count()
+              << " ms\n";
+#endif
+    N_ = N_total;
+}
+
+void ncvis::NCVis::degrees(size_t *out) {
+    if (!keep_index_) {
+        throw std::runtime_error("[ncvis::NCVis::degrees] The graph is only kept with keep_index set.");
+    }
+    for (size_t i = 0; i < neighbors_.size(); ++i) {
+        out[i] = neighbors_[i].size();
+    }
 }
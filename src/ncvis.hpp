@@ -7,6 +7,7 @@
 #include <iostream>
 #include <ostream>
 #include <utility>
+#include <vector>
 
 #include "knntable.hpp"
 
@@ -31,6 +32,21 @@ enum Distance {
     correlation
 };
 
+/*!
+@brief Optimization progress callback.
+
+The embedding is copied at the end of an epoch and the copy is passed to the callback in a separate thread, while the optimization goes on. The optimization only waits if the previous snapshot has not been taken by the callback yet. The callback must not throw.
+
+@param Y Pointer to the snapshot of the embedding [N, d]. Only valid during the call.
+@param N Number of samples.
+@param d Embedding dimensionality.
+@param Q Current value of the normalization constant.
+@param epoch Index of the epoch the snapshot was taken after.
+@param data User pointer passed to NCVis::set_snapshot_callback.
+@return Whether the optimization should continue. Once false is returned, no more snapshots are passed and the optimization stops at the next snapshot point.
+*/
+typedef bool (*SnapshotCallback)(const float *Y, size_t N, size_t d, float Q, int epoch, void *data);
+
 class NCVis {
    public:
     /*!
@@ -50,8 +66,9 @@ class NCVis {
     @param alpha,alpha_Q Learning rates for the embedding and normalization constant correspondingly.
     @param n_noise Number of noise samples per data sample for each iteration. An array of size [n_epochs]; will be initialized to 3 noise samples per data sample for each epoch if not provided.
     @param dist Distance to use for nearest neighbors search.
+    @param keep_index Whether to keep the HNSW index and the neighbors graph after fit_transform, which is required by partial_fit.
     */
-    NCVis(size_t d = 2, size_t n_threads = 1, size_t n_neighbors = 30, size_t M = 16, size_t ef_construction = 200, size_t random_seed = 42, int n_epochs = 50, int n_init_epochs = 20, float a = 1., float b = 1., float alpha = 1., float alpha_Q = 1., size_t *n_noise = nullptr, ncvis::Distance dist = ncvis::Distance::squared_L2);
+    NCVis(size_t d = 2, size_t n_threads = 1, size_t n_neighbors = 30, size_t M = 16, size_t ef_construction = 200, size_t random_seed = 42, int n_epochs = 50, int n_init_epochs = 20, float a = 1., float b = 1., float alpha = 1., float alpha_Q = 1., size_t *n_noise = nullptr, ncvis::Distance dist = ncvis::Distance::squared_L2, bool keep_index = false);
     ~NCVis();
     /*!
     @brief Build embedding for points.
@@ -64,6 +81,68 @@ class NCVis {
     @param Y Pointer to the embedding [N, d]. The j-th coordinate of i-th sample is assumed to be found at (X+d*i+j).
     */
     void fit_transform(const float *const X, size_t N, size_t D, float *Y);
+    /*!
+    @brief Build the nearest neighbors graph and the initial embedding.
+
+    Performs every step of fit_transform except the optimization, so that the epochs can be run separately with optimize, e.g. split between several processes.
+
+    @param X Pointer to the data array [N, D].
+    @param N Number of samples.
+    @param D Dimensionality of samples.
+    @param Y Pointer to the embedding [N, d] to initialize.
+    @return Edges of the symmetrized neighbors graph sorted by the first endpoint.
+    */
+    std::vector<Edge> init_transform(const float *const X, size_t N, size_t D, float *Y);
+    /*!
+    @brief Run optimization epochs over the given edges.
+
+    Runs epochs [first_epoch, last_epoch) of the learning rate and noise schedule. Only the edges passed are used as positive samples, while the noise samples are drawn from all N points. A positive sample only moves the first endpoint of its edge, so a pair of points is attracted both ways only if the list holds both (i, j) and (j, i), as the symmetrized graph from init_transform does. An edge present in one direction only pulls its first endpoint.
+
+    @param N Number of samples.
+    @param Y Pointer to the embedding [N, d].
+    @param Q Normalization constant, updated in place.
+    @param edges Edges sorted by the first endpoint, both directions of a pair for mutual attraction.
+    @param first_epoch,last_epoch Range of epochs to run.
+    */
+    void optimize(size_t N, float *Y, float &Q, std::vector<ncvis::Edge> &edges, int first_epoch, int last_epoch);
+    /*!
+    @brief Split edges into contiguous parts of roughly equal size.
+
+    Used to split the work between threads in optimize and between processes in the sharded mode. Rows of ordinary degree are never split between parts, while hubs are split evenly.
+
+    @param edges Edges sorted by the first endpoint.
+    @param n_parts Number of parts.
+    @return Part boundaries [n_parts+1]: the i-th part holds the edges [bounds[i], bounds[i+1]).
+    */
+    std::vector<size_t> partition_edges(std::vector<ncvis::Edge> &edges, size_t n_parts);
+    /*!
+    @brief Add points to the existing embedding.
+
+    Inserts new points into the index kept by the previous fit_transform or partial_fit call, updates the neighbors of the affected points only, keeping at most 2*n_neighbors of them for the points that had fewer, places each new point at the mean position of its old neighbors and runs the last n_epochs epochs of the optimization on the edges of the affected points. Requires keep_index to be set.
+
+    @param X Pointer to the new data array [N, D].
+    @param N Number of new samples.
+    @param D Dimensionality of samples, should match the one used for fit_transform.
+    @param Y Pointer to the embedding [N_old+N, d]. The first N_old rows should hold the current embedding, the rest is filled with the new points.
+    @param n_epochs Number of optimization epochs to run, at most the total number of epochs.
+    */
+    void partial_fit(const float *const X, size_t N, size_t D, float *Y, int n_epochs);
+    /*!
+    @brief Get the number of neighbors of each point in the kept graph. Requires keep_index to be set.
+
+    @param out Pointer to the array [N] to fill, where N is the total number of points added so far.
+    */
+    void degrees(size_t *out);
+    /*!
+    @brief Set optimization progress callback.
+
+    A snapshot is taken after every `every` epochs and after the last one. If the callback returns false, the optimization stops at the next snapshot point and fit_transform returns the embedding built so far. All the callbacks are finished by the time fit_transform returns.
+
+    @param callback Function to call, nullptr disables the callback.
+    @param data Pointer passed to the callback as is.
+    @param every Number of epochs between the calls.
+    */
+    void set_snapshot_callback(SnapshotCallback callback, void *data = nullptr, int every = 1);
 
    private:
     size_t d_;
@@ -78,6 +157,20 @@ class NCVis {
     float alpha_;
     float alpha_Q_;
     size_t *n_noise_;
+    SnapshotCallback callback_;
+    void *callback_data_;
+    int callback_every_;
+
+    // Number of optimize calls since init_transform, moves the random streams forward
+    size_t n_runs_;
+
+    // State kept between fit_transform and partial_fit
+    bool keep_index_;
+    size_t N_;
+    size_t D_;
+    float Q_;
+    std::vector<std::vector<long> > neighbors_;
+    std::vector<std::vector<float> > neighbor_dists_;
 
     hnswlib::SpaceInterface<float> *space_;
     hnswlib::HierarchicalNSW<float> *appr_alg_;
@@ -86,10 +179,10 @@ class NCVis {
     void preprocess(const float *const x, size_t D, ncvis::Distance dist, float *out);
     float d_sqr(const float *const x, const float *const y);
     void buildKNN(const float *const X, size_t N, size_t D);
+    void add_points(const float *const X, size_t N, size_t D, size_t first_label);
     KNNTable findKNN(const float *const X, size_t N, size_t D, size_t k);
     std::vector<Edge> build_edges(KNNTable &table);
     void init_embedding(size_t N, float *Y, float alpha, std::vector<ncvis::Edge> &edges);
-    void optimize(size_t N, float *Y, float &Q, std::vector<ncvis::Edge> &edges);
 };
 }  // namespace ncvis
 
@@ -1,3 +1,7 @@
+from libcpp cimport bool
+from libcpp.utility cimport pair
+from libcpp.vector cimport vector
+
 cdef extern from "../src/ncvis.hpp" namespace "ncvis":
     cdef enum Distance:
         squared_L2,
@@ -5,7 +9,17 @@ cdef extern from "../src/ncvis.hpp" namespace "ncvis":
         cosine_similarity,
         correlation
 
+cdef extern from "../src/ncvis.hpp" namespace "ncvis":
+    ctypedef pair[size_t, size_t] Edge
+    ctypedef bool (*SnapshotCallback)(const float* Y, size_t N, size_t d, float Q, int epoch, void* data) noexcept nogil
+
 cdef extern from "../src/ncvis.hpp" namespace "ncvis":
     cdef cppclass NCVis:
-        NCVis(size_t d, size_t n_threads, size_t n_neighbors, size_t M, size_t ef_construction, size_t random_seed, int n_epochs, int n_init_epochs, float a, float b, float alpha, float alpha_Q, size_t* n_noise, Distance dist) except +
-        void fit_transform(const float *const X, size_t N, size_t D, float* Y)
+        NCVis(size_t d, size_t n_threads, size_t n_neighbors, size_t M, size_t ef_construction, size_t random_seed, int n_epochs, int n_init_epochs, float a, float b, float alpha, float alpha_Q, size_t* n_noise, Distance dist, bool keep_index) except +
+        void fit_transform(const float *const X, size_t N, size_t D, float* Y) except + nogil
+        vector[Edge] init_transform(const float *const X, size_t N, size_t D, float* Y) except + nogil
+        void optimize(size_t N, float* Y, float& Q, vector[Edge]& edges, int first_epoch, int last_epoch) except + nogil
+        vector[size_t] partition_edges(vector[Edge]& edges, size_t n_parts) except +
+        void partial_fit(const float *const X, size_t N, size_t D, float* Y, int n_epochs) except + nogil
+        void degrees(size_t* out) except +
+        void set_snapshot_callback(SnapshotCallback callback, void* data, int every) except +
@@ -1,7 +1,12 @@
 from wrapper cimport cncvis
 import numpy as np
 cimport numpy as cnp
-from multiprocessing import cpu_count
+from libc.string cimport memcpy
+from libcpp cimport bool
+from libcpp.vector cimport vector
+import multiprocessing
+from multiprocessing import cpu_count, shared_memory
+from multiprocessing.connection import wait
 
 from scipy.optimize import curve_fit
 def find_ab_params(spread=1., min_dist=0.1):
@@ -23,11 +28,30 @@ def find_ab_params(spread=1., min_dist=0.1):
     params, covar = curve_fit(curve, xv, yv)
     return params[0], params[1]
 
+cdef bint call_snapshot(const float* Y, size_t N, size_t d, float Q, int epoch, NCVisWrapper wrapper):
+    cdef float[:, ::1] Y_view
+    try:
+        Y_copy = np.empty((N, d), dtype=np.float32)
+        Y_view = Y_copy
+        memcpy(&Y_view[0, 0], Y, N * d * sizeof(float))
+        return wrapper.callback(Y_copy, Q, epoch) is not False
+    except BaseException as e:
+        wrapper.callback_error = e
+        return False
+
+cdef bool snapshot_callback(const float* Y, size_t N, size_t d, float Q, int epoch, void* data) noexcept nogil:
+    # Called from the snapshot thread of the C++ core, which holds no GIL
+    with gil:
+        return call_snapshot(Y, N, d, Q, epoch, <NCVisWrapper>data)
+
 cdef class NCVisWrapper:
     cdef cncvis.NCVis* c_ncvis
     cdef size_t d
+    cdef object callback
+    cdef object callback_error
+    cdef vector[cncvis.Edge] edges
 
-    def __cinit__(self, size_t d, size_t n_threads, size_t n_neighbors, size_t M, size_t ef_construction, size_t random_seed, int n_epochs, int n_init_epochs, float a, float b, float alpha, float alpha_Q, object n_noise, cncvis.Distance distance):
+    def __cinit__(self, size_t d, size_t n_threads, size_t n_neighbors, size_t M, size_t ef_construction, size_t random_seed, int n_epochs, int n_init_epochs, float a, float b, float alpha, float alpha_Q, object n_noise, cncvis.Distance distance, bint keep_index):
         cdef cnp.uintp_t[:] n_noise_arr
         if isinstance(n_noise, int):
             n_noise_arr = np.full(n_epochs, n_noise, dtype=np.uintp)
@@ -36,17 +60,118 @@ cdef class NCVisWrapper:
                 raise ValueError("Expected 1D n_noise array.")
             n_epochs = n_noise.shape[0]
             n_noise_arr = n_noise.astype(np.uintp)
-        self.c_ncvis = new cncvis.NCVis(d, n_threads, n_neighbors, M, ef_construction, random_seed, n_epochs, n_init_epochs, a, b, alpha, alpha_Q, &n_noise_arr[0], distance)
+        self.c_ncvis = new cncvis.NCVis(d, n_threads, n_neighbors, M, ef_construction, random_seed, n_epochs, n_init_epochs, a, b, alpha, alpha_Q, &n_noise_arr[0], distance, keep_index)
         self.d = d
 
     def __dealloc__(self):
         del self.c_ncvis
 
-    def fit_transform(self, float[:, :] X, float[:, :] Y):
-        self.c_ncvis.fit_transform(&X[0, 0], X.shape[0], X.shape[1], &Y[0, 0])
+    cdef set_callback(self, object callback, int callback_every):
+        self.callback = callback
+        self.callback_error = None
+        if callback is None:
+            self.c_ncvis.set_snapshot_callback(NULL, NULL, 1)
+        else:
+            self.c_ncvis.set_snapshot_callback(snapshot_callback, <void*>self, callback_every)
+
+    cdef raise_callback_error(self):
+        self.callback = None
+        if self.callback_error is not None:
+            error, self.callback_error = self.callback_error, None
+            raise error
+
+    def fit_transform(self, float[:, :] X, float[:, :] Y, object callback=None, int callback_every=1):
+        self.set_callback(callback, callback_every)
+        try:
+            with nogil:
+                self.c_ncvis.fit_transform(&X[0, 0], X.shape[0], X.shape[1], &Y[0, 0])
+        finally:
+            self.raise_callback_error()
+
+    def partial_fit(self, float[:, :] X, float[:, :] Y, int n_epochs, object callback=None, int callback_every=1):
+        self.set_callback(callback, callback_every)
+        try:
+            with nogil:
+                self.c_ncvis.partial_fit(&X[0, 0], X.shape[0], X.shape[1], &Y[0, 0], n_epochs)
+        finally:
+            self.raise_callback_error()
+
+    def degrees(self, size_t N):
+        cdef cnp.uintp_t[:] out_view
+        out = np.empty(N, dtype=np.uintp)
+        out_view = out
+        if N > 0:
+            self.c_ncvis.degrees(<size_t*>&out_view[0])
+        return out
+
+    def init_transform(self, float[:, :] X, float[:, :] Y):
+        cdef cnp.uintp_t[:, ::1] edges_view
+        cdef size_t i
+        with nogil:
+            self.edges = self.c_ncvis.init_transform(&X[0, 0], X.shape[0], X.shape[1], &Y[0, 0])
+        edges_arr = np.empty((self.edges.size(), 2), dtype=np.uintp)
+        edges_view = edges_arr
+        for i in range(self.edges.size()):
+            edges_view[i, 0] = self.edges[i].first
+            edges_view[i, 1] = self.edges[i].second
+        return edges_arr
+
+    def partition_edges(self, size_t n_parts):
+        return list(self.c_ncvis.partition_edges(self.edges, n_parts))
+
+    def clear_edges(self):
+        self.edges.clear()
+        self.edges.shrink_to_fit()
+
+    def set_edges(self, const cnp.uintp_t[:, :] edges):
+        cdef cncvis.Edge edge
+        cdef size_t i
+        self.edges.clear()
+        self.edges.reserve(edges.shape[0])
+        for i in range(edges.shape[0]):
+            edge.first = edges[i, 0]
+            edge.second = edges[i, 1]
+            self.edges.push_back(edge)
+
+    def optimize(self, float[:, :] Y, float Q, int first_epoch, int last_epoch):
+        with nogil:
+            self.c_ncvis.optimize(Y.shape[0], &Y[0, 0], Q, self.edges, first_epoch, last_epoch)
+        return Q
+
+def shard_worker(tuple params, int worker, int n_workers, str Y_name, tuple Y_shape, str edges_name, tuple edges_shape, size_t edges_begin, size_t edges_end, str Q_name, float Q, object barrier, int n_epochs, int sync_every):
+    """
+    Runs the optimization over one shard of edges in a worker process.
+
+    The embedding is shared between the workers, while the normalization
+    constant is averaged over them every ``sync_every`` epochs.
+    """
+    Y_shm = shared_memory.SharedMemory(name=Y_name)
+    edges_shm = shared_memory.SharedMemory(name=edges_name)
+    Q_shm = shared_memory.SharedMemory(name=Q_name)
+    Y = edges = Q_all = None
+    try:
+        Y = np.ndarray(Y_shape, dtype=np.float32, buffer=Y_shm.buf)
+        edges = np.ndarray(edges_shape, dtype=np.uintp, buffer=edges_shm.buf)
+        Q_all = np.ndarray((2, n_workers), dtype=np.float32, buffer=Q_shm.buf)
+
+        model = NCVisWrapper(*params)
+        model.set_edges(edges[edges_begin:edges_end])
+        for period, first_epoch in enumerate(range(0, n_epochs, sync_every)):
+            Q = model.optimize(Y, Q, first_epoch, min(first_epoch + sync_every, n_epochs))
+            # Slots alternate, so a slot is only rewritten after all the workers
+            # have passed the next barrier and thus have read it
+            Q_all[period % 2, worker] = Q
+            barrier.wait()
+            Q = float(Q_all[period % 2].mean())
+    finally:
+        # Views must be released before the shared memory is closed
+        Y = edges = Q_all = None
+        Y_shm.close()
+        edges_shm.close()
+        Q_shm.close()
 
 class NCVis:
-    def __init__(self, d=2, n_threads=-1, n_neighbors=15, M=8, ef_construction=100, random_seed=42, n_epochs=50, n_init_epochs=20, spread=1., min_dist=0.4, a=None, b=None, alpha=1., alpha_Q=1., n_noise=None, distance="euclidean"):
+    def __init__(self, d=2, n_threads=-1, n_neighbors=15, M=8, ef_construction=100, random_seed=42, n_epochs=50, n_init_epochs=20, spread=1., min_dist=0.4, a=None, b=None, alpha=1., alpha_Q=1., n_noise=None, distance="euclidean", keep_index=False, n_workers=1, sync_every=1):
         """
         Creates new NCVis instance.
 
@@ -98,8 +223,19 @@ class NCVis:
             Number of noise samples to use per data sample. If ndarray is provided, n_epochs is set to its length. If n_noise is None, it is set to dynamic sampling with noise level gradually increasing from 0 to fixed value. 
         distance : str {'euclidean', 'cosine', 'correlation', 'inner_product'}
             Distance to use for nearest neighbors search.
+        keep_index : bool
+            Whether to keep the nearest neighbors index and graph after ``fit_transform``. Required by ``partial_fit``.
+        n_workers : int
+            Number of local processes to split the optimization between. Each worker owns a contiguous range
+            of points and runs the epochs over their edges with ``n_threads // n_workers`` threads, while the
+            embedding is shared between the workers through shared memory. The workers are started with the
+            "spawn" method, so the calling script should be guarded by ``if __name__ == "__main__":``.
+        sync_every : int
+            Number of epochs between the exchanges of the normalization constant between the workers.
         """
         self.d = d
+        self.n_points = 0
+        self.embedding = None
         if n_noise is None:
             n_negative = 5
 
@@ -125,6 +261,13 @@ class NCVis:
         if n_threads < 1:
             n_threads = cpu_count()
 
+        if n_workers < 1:
+            raise ValueError("n_workers should be at least 1, but {} was passed".format(n_workers))
+        if sync_every < 1:
+            raise ValueError("sync_every should be at least 1, but {} was passed".format(sync_every))
+        if n_workers > 1 and keep_index:
+            raise ValueError("keep_index is not supported with n_workers > 1")
+
         distances = {
             'euclidean': cncvis.squared_L2,
             'cosine': cncvis.cosine_similarity, 
@@ -140,9 +283,16 @@ class NCVis:
             else:
                 raise ValueError(f'Expected (a, b) to be (float, float) or (None, None),con but got (a, b) = ({a}, {b})')
 
-        self.model = NCVisWrapper(d, n_threads, n_neighbors, M, ef_construction, random_seed, n_epochs, n_init_epochs, a, b, alpha, alpha_Q, negative_plan, distances[distance])
+        self.n_epochs = n_epochs
+        self.keep_index = keep_index
+        self.n_workers = n_workers
+        self.sync_every = sync_every
+        self.model = NCVisWrapper(d, n_threads, n_neighbors, M, ef_construction, random_seed, n_epochs, n_init_epochs, a, b, alpha, alpha_Q, negative_plan, distances[distance], keep_index)
+        # Each worker gets its share of threads and its own range of random seeds
+        n_worker_threads = max(1, n_threads // n_workers)
+        self.worker_params = [(d, n_worker_threads, n_neighbors, M, ef_construction, random_seed + w * n_worker_threads, n_epochs, n_init_epochs, a, b, alpha, alpha_Q, negative_plan, distances[distance], False) for w in range(n_workers)]
 
-    def fit_transform(self, X):
+    def fit_transform(self, X, callback=None, callback_every=1):
         """
         Builds an embedding for given points.
 
@@ -150,14 +300,178 @@ class NCVis:
         ----------
         X : ndarray of size [n_samples, n_high_dimensions]
             The data samples. Will be converted to float by default.
+        callback : callable (optional, default None)
+            Called as ``callback(Y, Q, epoch)`` during optimization, where ``Y`` is a snapshot of
+            the embedding, ``Q`` is the normalization constant and ``epoch`` is the index of the
+            epoch the snapshot was taken after. The callback runs in a separate thread while the
+            optimization goes on, which only waits if the previous snapshot has not been taken yet.
+            Returning False stops the optimization at the next snapshot, and the embedding built
+            so far is returned. Exceptions raised by the callback stop the optimization the same
+            way and are propagated.
+        callback_every : int
+            Number of epochs between the callback calls. The callback is always called after the last epoch.
 
         Returns:
         --------
         Y : ndarray of floats of size [n_samples, m_low_dimensions]
             The embedding of the data samples.
         """
+        if callback_every < 1:
+            raise ValueError("callback_every should be at least 1, but {} was passed".format(callback_every))
+        if self.n_workers > 1:
+            if callback is not None:
+                raise ValueError("callback is not supported with n_workers > 1")
+            return self.fit_transform_sharded(X)
         Y = np.empty((X.shape[0], self.d), dtype=np.float32)
         self.model.fit_transform(np.ascontiguousarray(X, dtype=np.float32),
-                                 np.ascontiguousarray(Y, dtype=np.float32))
+                                 np.ascontiguousarray(Y, dtype=np.float32),
+                                 callback, callback_every)
+        self.n_points = X.shape[0]
+        if self.keep_index:
+            self.embedding = Y
+
+        return Y
+
+    def partial_fit(self, X, Y=None, n_epochs=None, callback=None, callback_every=1):
+        """
+        Adds new points to the embedding built by the previous ``fit_transform`` or ``partial_fit`` call.
+        Requires ``keep_index=True``. Only the neighborhoods of the new points are updated, so the cost
+        grows with the number of new points rather than with the total number of points.
+
+        Parameters
+        ----------
+        X : ndarray of size [n_new_samples, n_high_dimensions]
+            The new data samples. Will be converted to float by default.
+        Y : ndarray of size [n_samples, m_low_dimensions] (optional, default None)
+            The current embedding of all previously added samples. If None or the array returned by the
+            previous call, it is updated in place. Any other array is copied, which is a pass over all the samples.
+        n_epochs : int (optional, default None)
+            The number of optimization epochs to run, taken from the end of the schedule.
+            Defaults to one fifth of the total number of epochs.
+        callback : callable (optional, default None)
+            See ``fit_transform``.
+        callback_every : int
+            See ``fit_transform``.
+
+        Returns:
+        --------
+        Y : ndarray of floats of size [n_samples + n_new_samples, m_low_dimensions]
+            The updated embedding of all the samples, the new ones at the end. It is a view of an
+            internal buffer, which later calls update in place.
+        """
+        if not self.keep_index:
+            raise ValueError("partial_fit requires NCVis to be created with keep_index=True")
+        if self.embedding is None:
+            raise ValueError("partial_fit requires fit_transform to be called first")
+        if Y is not None and Y.shape != (self.n_points, self.d):
+            raise ValueError("Expected Y of shape {}, but got {}".format((self.n_points, self.d), Y.shape))
+        if n_epochs is None:
+            n_epochs = max(1, self.n_epochs // 5)
+        if n_epochs < 1:
+            raise ValueError("n_epochs should be at least 1, but {} was passed".format(n_epochs))
+        if callback_every < 1:
+            raise ValueError("callback_every should be at least 1, but {} was passed".format(callback_every))
+
+        n_total = self.n_points + X.shape[0]
+        in_place = Y is None or (Y.dtype == np.float32 and Y.flags.c_contiguous and
+                                 Y.__array_interface__['data'][0] == self.embedding.__array_interface__['data'][0])
+        if self.embedding.shape[0] < n_total:
+            # Grow geometrically, so that copying the old rows is amortized
+            embedding = np.empty((max(n_total, 2 * self.embedding.shape[0]), self.d), dtype=np.float32)
+            embedding[:self.n_points] = self.embedding[:self.n_points] if in_place else Y
+            self.embedding = embedding
+        elif not in_place:
+            self.embedding[:self.n_points] = Y
+        Y_all = self.embedding[:n_total]
+        if X.shape[0] > 0:
+            self.model.partial_fit(np.ascontiguousarray(X, dtype=np.float32), Y_all,
+                                   n_epochs, callback, callback_every)
+        self.n_points = n_total
+
+        return Y_all
+
+    def degrees(self):
+        """
+        Returns the number of neighbors of each sample in the graph kept for ``partial_fit``.
+
+        Returns:
+        --------
+        degrees : ndarray of ints of size [n_samples]
+        """
+        if not self.keep_index:
+            raise ValueError("degrees requires NCVis to be created with keep_index=True")
+        return self.model.degrees(self.n_points)
+
+    def fit_transform_sharded(self, X):
+        """
+        Builds an embedding for given points splitting the optimization between ``n_workers`` processes.
+        The nearest neighbors graph and the initial embedding are built in the calling process.
+
+        Parameters
+        ----------
+        X : ndarray of size [n_samples, n_high_dimensions]
+            The data samples. Will be converted to float by default.
+
+        Returns:
+        --------
+        Y : ndarray of floats of size [n_samples, m_low_dimensions]
+            The embedding of the data samples.
+        """
+        X = np.ascontiguousarray(X, dtype=np.float32)
+        Y = np.empty((X.shape[0], self.d), dtype=np.float32)
+        edges = self.model.init_transform(X, Y)
+
+        # Same partitioning as between the threads of one process
+        n_workers = self.n_workers
+        bounds = self.model.partition_edges(n_workers)
+        self.model.clear_edges()
+
+        ctx = multiprocessing.get_context("spawn")
+        barrier = ctx.Barrier(n_workers)
+        shms = []
+        workers = []
+        Y_shared = edges_shared = None
+        try:
+            shms.append(shared_memory.SharedMemory(create=True, size=Y.nbytes))
+            shms.append(shared_memory.SharedMemory(create=True, size=max(edges.nbytes, 1)))
+            shms.append(shared_memory.SharedMemory(create=True, size=2 * n_workers * np.dtype(np.float32).itemsize))
+            Y_shm, edges_shm, Q_shm = shms
+            Y_shared = np.ndarray(Y.shape, dtype=np.float32, buffer=Y_shm.buf)
+            Y_shared[:] = Y
+            edges_shared = np.ndarray(edges.shape, dtype=np.uintp, buffer=edges_shm.buf)
+            edges_shared[:] = edges
+            del edges
+
+            for w in range(n_workers):
+                p = ctx.Process(target=shard_worker, args=(
+                    self.worker_params[w], w, n_workers,
+                    Y_shm.name, Y.shape, edges_shm.name, edges_shared.shape, bounds[w], bounds[w + 1],
+                    Q_shm.name, 0., barrier, self.n_epochs, self.sync_every))
+                p.start()
+                # Only started processes can be joined on cleanup
+                workers.append(p)
+
+            # A failed worker would leave the others waiting at the barrier forever
+            failed = False
+            pending = {p.sentinel: p for p in workers}
+            while pending:
+                for sentinel in wait(list(pending)):
+                    p = pending.pop(sentinel)
+                    p.join()
+                    if p.exitcode != 0 and not failed:
+                        failed = True
+                        barrier.abort()
+            if failed:
+                raise RuntimeError("Sharded optimization failed in one of the worker processes")
+            Y[:] = Y_shared
+        finally:
+            for p in workers:
+                if p.is_alive():
+                    p.terminate()
+                p.join()
+            Y_shared = edges_shared = None
+            for shm in shms:
+                shm.close()
+                shm.unlink()
 
         return Y